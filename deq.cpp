@@ -3,22 +3,45 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <charconv>
+#include <chrono>
 #include <deque>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
 #include <cctype>
 #include <cerrno>
+#include <csignal>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using s64 = std::int64_t;
 using s32 = std::int32_t;
@@ -43,6 +66,41 @@ using f64 = double;
         abort();                                                               \
     } while (0)
 
+// Execution statistics, `make STATS=0` compiles the counters and everything
+// that feeds them out
+#ifndef DEQ_STATS
+#    define DEQ_STATS 1
+#endif
+
+#if DEQ_STATS
+#    define STAT(expr) (expr)
+#else
+#    define STAT(expr) ((void)0)
+#endif
+
+// Why the run stopped, reported by `--stats`
+enum class Failure {
+    None,
+    Compile,
+    Syntax,
+    Type,
+    Underflow,
+    CallStack,
+    Conversion,
+    Snapshot,
+    Io,
+};
+
+#if DEQ_STATS
+static Failure failure = Failure::None;
+#endif
+
+#define FAIL(kind)                                                             \
+    do {                                                                       \
+        STAT(failure = Failure::kind);                                         \
+        std::exit(1);                                                          \
+    } while (0)
+
 struct Location {
     std::string filename;
     u64 col;
@@ -61,7 +119,7 @@ struct Token {
 };
 
 struct Value {
-    using As = std::variant<s64, f64, std::string>;
+    using As = std::variant<s64, f64, std::string_view>;
     enum class Type {
         Integer = 0,
         Real,
@@ -82,7 +140,9 @@ struct Value {
         as = real;
     }
 
-    Value(const Token& tok, std::string str)
+    // `str` must outlive the run: it points either into a token or into the
+    // machine's arena
+    Value(const Token& tok, std::string_view str)
         : tok(tok)
     {
         type = Type::String;
@@ -108,13 +168,40 @@ static std::string human(Value::Type t, bool plural = false)
     }
 }
 
+// Enough for any s64 and for the shortest round-trip form of any f64
+using NumberBuffer = std::array<char, 32>;
+
+template <typename T>
+static std::string_view format_number(NumberBuffer& buf, T num)
+{
+    auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), num);
+    (void)ec;
+    return { buf.data(), static_cast<usz>(end - buf.data()) };
+}
+
+// Whole `s` must be consumed, otherwise it is not a number
+template <typename T>
+static std::optional<T> parse_number(std::string_view s)
+{
+    T num {};
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), num);
+    if (ec != std::errc {} || end != s.data() + s.size()) {
+        return {};
+    }
+
+    return num;
+}
+
 std::ostream& operator<<(std::ostream& os, const Value& v)
 {
+    NumberBuffer buf;
     if (auto* num = std::get_if<s64>(&v.as)) {
-        os << *num;
+        auto s = format_number(buf, *num);
+        os.write(s.data(), s.size());
     } else if (auto* real = std::get_if<f64>(&v.as)) {
-        os << *real;
-    } else if (auto* str = std::get_if<std::string>(&v.as)) {
+        auto s = format_number(buf, *real);
+        os.write(s.data(), s.size());
+    } else if (auto* str = std::get_if<std::string_view>(&v.as)) {
         os << *str;
     }
 
@@ -123,22 +210,616 @@ std::ostream& operator<<(std::ostream& os, const Value& v)
 
 using deq_t = Value;
 
-class Lexer {
+// Values are copied to disk byte by byte. Their pointers (tokens, strings) stay
+// valid because the file lives only as long as the run
+static_assert(std::is_trivially_copyable_v<deq_t>);
+
+// Storage of a `Deque`. By default everything is kept in memory. With spilling
+// enabled only up to two blocks near each end stay in memory, the middle is
+// moved to an unlinked temporary file one block at a time and is read back
+// when an end runs dry
+class SpillStorage {
 public:
-    Lexer(std::string filename)
+    SpillStorage() = default;
+    SpillStorage(const SpillStorage&) = delete;
+    SpillStorage& operator=(const SpillStorage&) = delete;
+
+    ~SpillStorage()
     {
-        loc = Location { filename, 0, 0 };
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
 
-        std::ifstream infile { filename };
-        if (!infile.is_open()) {
-            std::cerr << "[ERR] Failed to open file '" << filename
+    // `block` is the number of values moved to or from the file at once
+    void spill_to_disk(usz block)
+    {
+        const char* dir = std::getenv("TMPDIR");
+        std::string path = std::string(dir ? dir : "/tmp") + "/deq-XXXXXX";
+        fd = ::mkstemp(path.data());
+        if (fd < 0) {
+            std::cerr << "[ERR] Failed to create spill file '" << path
                       << "': " << std::strerror(errno) << '\n';
-            std::exit(1);
+            FAIL(Io);
+        }
+        ::unlink(path.c_str());
+
+        usz page = ::sysconf(_SC_PAGESIZE);
+        this->block = block;
+        block_bytes = (block * sizeof(deq_t) + page - 1) / page * page;
+    }
+
+    usz size() const
+    {
+        return near_front.size() + cold.size() * block + near_back.size();
+    }
+
+    bool empty() const { return size() == 0; }
+
+    void push_front(const deq_t& v)
+    {
+        near_front.push_front(v);
+        if (block > 0 && near_front.size() > 2 * block) {
+            // The innermost values of the front border the cold middle
+            cold.push_front(store(near_front.end() - block));
+            for (usz i = 0; i < block; i++) {
+                near_front.pop_back();
+            }
+        }
+    }
+
+    void push_back(const deq_t& v)
+    {
+        near_back.push_back(v);
+        if (block > 0 && near_back.size() > 2 * block) {
+            cold.push_back(store(near_back.begin()));
+            for (usz i = 0; i < block; i++) {
+                near_back.pop_front();
+            }
+        }
+    }
+
+    // The storage must not be empty
+    deq_t pop_front()
+    {
+        if (near_front.empty() && !cold.empty()) {
+            load(cold.front(), near_front);
+            cold.pop_front();
+        }
+
+        auto& from = near_front.empty() ? near_back : near_front;
+        deq_t v = from.front();
+        from.pop_front();
+        return v;
+    }
+
+    deq_t pop_back()
+    {
+        if (near_back.empty() && !cold.empty()) {
+            load(cold.back(), near_back);
+            cold.pop_back();
+        }
+
+        auto& from = near_back.empty() ? near_front : near_back;
+        deq_t v = from.back();
+        from.pop_back();
+        return v;
+    }
+
+    void clear()
+    {
+        near_front.clear();
+        near_back.clear();
+        for (u64 offset : cold) {
+            free_blocks.push_back(offset);
+        }
+        cold.clear();
+    }
+
+    // Cold blocks are mapped one at a time
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (const auto& v : near_front) {
+            f(v);
+        }
+        for (u64 offset : cold) {
+            const auto* values = static_cast<const deq_t*>(
+                map(offset, PROT_READ));
+            for (usz i = 0; i < block; i++) {
+                f(values[i]);
+            }
+            ::munmap(const_cast<deq_t*>(values), block_bytes);
+        }
+        for (const auto& v : near_back) {
+            f(v);
+        }
+    }
+
+private:
+    void* map(u64 offset, int prot) const
+    {
+        void* ptr = ::mmap(nullptr, block_bytes, prot, MAP_SHARED, fd, offset);
+        if (ptr == MAP_FAILED) {
+            std::cerr << "[ERR] Failed to map spill file: "
+                      << std::strerror(errno) << '\n';
+            FAIL(Io);
+        }
+        return ptr;
+    }
+
+    // Writes `block` values starting at `from` to a free block of the file
+    u64 store(std::deque<deq_t>::const_iterator from)
+    {
+        u64 offset;
+        if (!free_blocks.empty()) {
+            offset = free_blocks.back();
+            free_blocks.pop_back();
+        } else {
+            offset = file_size;
+            if (::ftruncate(fd, file_size + block_bytes) < 0) {
+                std::cerr << "[ERR] Failed to grow spill file: "
+                          << std::strerror(errno) << '\n';
+                FAIL(Io);
+            }
+            file_size += block_bytes;
+        }
+
+        auto* values = static_cast<deq_t*>(map(offset, PROT_WRITE));
+        for (usz i = 0; i < block; i++, from++) {
+            std::memcpy(static_cast<void*>(&values[i]), &*from, sizeof(deq_t));
+        }
+        ::munmap(values, block_bytes);
+        return offset;
+    }
+
+    void load(u64 offset, std::deque<deq_t>& to)
+    {
+        const auto* values = static_cast<const deq_t*>(map(offset, PROT_READ));
+        for (usz i = 0; i < block; i++) {
+            to.push_back(values[i]);
+        }
+        ::munmap(const_cast<deq_t*>(values), block_bytes);
+        free_blocks.push_back(offset);
+    }
+
+    std::deque<deq_t> near_front;
+    std::deque<u64> cold;
+    std::deque<deq_t> near_back;
+
+    int fd = -1;
+    usz block {};
+    usz block_bytes {};
+    u64 file_size {};
+    std::vector<u64> free_blocks;
+};
+
+// The deque of a machine, its storage optionally spilled to disk
+class Deque {
+public:
+    usz size() const { return len; }
+#if DEQ_STATS
+    // Largest size the deque ever had, kept across `clear()`
+    usz peak() const { return high_water; }
+    // Counts values held outside of the deque, like `DequeEnds` does
+    void observe(usz size) { high_water = std::max(high_water, size); }
+#endif
+
+    void spill_to_disk(usz block) { storage.spill_to_disk(block); }
+
+    void push_front(const deq_t& v)
+    {
+        storage.push_front(v);
+        grow();
+    }
+
+    void push_back(const deq_t& v)
+    {
+        storage.push_back(v);
+        grow();
+    }
+
+    // The deque must not be empty
+    deq_t pop_front()
+    {
+        len--;
+        return storage.pop_front();
+    }
+
+    deq_t pop_back()
+    {
+        len--;
+        return storage.pop_back();
+    }
+
+    void clear()
+    {
+        storage.clear();
+        len = 0;
+    }
+
+    template <typename F>
+    void for_each(F f) const
+    {
+        storage.for_each(f);
+    }
+
+private:
+    void grow()
+    {
+        len++;
+        STAT(high_water = std::max(high_water, len));
+    }
+
+    SpillStorage storage;
+    usz len {};
+#if DEQ_STATS
+    usz high_water {};
+#endif
+};
+
+// The outermost value of each end of a deque, held by `interpret()` outside
+// of the storage. Words like `add!` pop and push at one end, so they mostly
+// work on the cached value alone. The cache is written back with `flush()`
+// before anything looks at the deque itself
+class DequeEnds {
+public:
+    explicit DequeEnds(Deque& deq)
+        : deq(deq)
+    {
+    }
+
+    usz size() const { return deq.size() + has_front + has_back; }
+
+    void push(const deq_t& v, bool front)
+    {
+        if (front) {
+            if (has_front) {
+                deq.push_front(load(front_value));
+            }
+            front_value = store(v);
+            has_front = true;
+        } else {
+            if (has_back) {
+                deq.push_back(load(back_value));
+            }
+            back_value = store(v);
+            has_back = true;
+        }
+        STAT(deq.observe(size()));
+    }
+
+    // The deque must not be empty
+    deq_t pop(bool front)
+    {
+        if (front && has_front) {
+            has_front = false;
+            return load(front_value);
+        }
+        if (!front && has_back) {
+            has_back = false;
+            return load(back_value);
+        }
+        if (deq.size() > 0) {
+            return front ? deq.pop_front() : deq.pop_back();
+        }
+
+        // The only value left is cached at the other end
+        has_front = has_back = false;
+        return load(front ? back_value : front_value);
+    }
+
+    void flush()
+    {
+        if (has_front) {
+            deq.push_front(load(front_value));
+        }
+        if (has_back) {
+            deq.push_back(load(back_value));
+        }
+        has_front = has_back = false;
+    }
+
+private:
+    // Values are not assignable, their bytes are
+    using Slot = std::array<std::byte, sizeof(deq_t)>;
+
+    static Slot store(const deq_t& v) { return std::bit_cast<Slot>(v); }
+    static deq_t load(const Slot& slot) { return std::bit_cast<deq_t>(slot); }
+
+    Deque& deq;
+    Slot front_value;
+    Slot back_value;
+    bool has_front = false;
+    bool has_back = false;
+};
+
+struct Frame {
+    usz ret;
+    bool left;
+};
+
+// Return stack of a fixed capacity, allocated once before the execution
+class CallStack {
+public:
+    explicit CallStack(usz capacity)
+        : frames(std::make_unique<Frame[]>(capacity))
+        , cap(capacity)
+    {
+    }
+
+    // Returns false on overflow
+    bool push(Frame f)
+    {
+        if (len == cap) {
+            return false;
+        }
+        frames[len++] = f;
+        return true;
+    }
+
+    Frame pop() { return frames[--len]; }
+
+    void clear() { len = 0; }
+
+    // nullptr if the call stack is empty
+    Frame* top() { return len > 0 ? &frames[len - 1] : nullptr; }
+
+    usz size() const { return len; }
+    usz capacity() const { return cap; }
+
+    const Frame* begin() const { return frames.get(); }
+    const Frame* end() const { return frames.get() + len; }
+
+private:
+    std::unique_ptr<Frame[]> frames;
+    usz cap;
+    usz len {};
+};
+
+// Bump allocator for the strings created during a run. Nothing is freed one by
+// one: `reset()` rewinds the whole arena and keeps its blocks for the next run.
+// Not thread-safe, every thread runs its own machine and so its own arena.
+class Arena {
+public:
+    explicit Arena(usz block_size = 64 * 1024)
+        : block_size(block_size)
+    {
+    }
+
+    char* alloc(usz n)
+    {
+        if (blocks.empty() || offset + n > blocks.at(current).size) {
+            next_block(n);
+        }
+
+        char* ptr = blocks.at(current).data.get() + offset;
+        offset += n;
+#if DEQ_STATS
+        used += n;
+        bytes += n;
+        high_water = std::max(high_water, used);
+        allocations++;
+#endif
+        return ptr;
+    }
+
+    std::string_view store(std::string_view s)
+    {
+        char* ptr = alloc(s.size());
+        std::memcpy(ptr, s.data(), s.size());
+        return { ptr, s.size() };
+    }
+
+    void reset()
+    {
+        current = 0;
+        offset = 0;
+        STAT(used = 0);
+    }
+
+#if DEQ_STATS
+    struct Stats {
+        usz used;
+        usz high_water;
+        usz reserved;
+        usz allocations;
+        usz bytes;
+    };
+
+    Stats stats() const
+    {
+        usz reserved = 0;
+        for (const auto& block : blocks) {
+            reserved += block.size;
+        }
+        return { used, high_water, reserved, allocations, bytes };
+    }
+#endif
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        usz size;
+    };
+
+    // Moves to the next block that fits `n` bytes, allocating it if needed
+    void next_block(usz n)
+    {
+        usz next = blocks.empty() ? 0 : current + 1;
+        if (next >= blocks.size() || blocks.at(next).size < n) {
+            usz size = std::max(block_size, n);
+            blocks.insert(blocks.begin() + next,
+                Block { std::make_unique<char[]>(size), size });
+        }
+        current = next;
+        offset = 0;
+    }
+
+    std::vector<Block> blocks;
+    usz block_size;
+    usz current {};
+    usz offset {};
+#if DEQ_STATS
+    usz used {};
+    usz high_water {};
+    usz allocations {};
+    usz bytes {};
+#endif
+};
+
+static constexpr usz DEFAULT_CALL_DEPTH = 8192;
+// The call stack is allocated up front, 16M frames take 256MB
+static constexpr usz MAX_CALL_DEPTH = 1 << 24;
+static constexpr usz DEFAULT_SPILL_BLOCK = 1 << 16;
+
+struct Options {
+    bool debug = false;
+    bool dump_ir = false;
+    int opt_level = 0;
+    usz call_depth = DEFAULT_CALL_DEPTH;
+    std::optional<std::string> cache_dir;
+    std::string snapshot_path;
+    std::optional<std::string> restore_path;
+    // Values per block of the spill file, 0 keeps the whole deque in memory
+    usz spill_block = 0;
+    usz workers = 0;
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile& operator=(MappedFile&& other)
+    {
+        std::swap(ptr, other.ptr);
+        std::swap(len, other.len);
+        return *this;
+    }
+
+    ~MappedFile()
+    {
+        if (ptr != nullptr) {
+            ::munmap(ptr, len);
+        }
+    }
+
+    // Returns false and sets errno on failure
+    bool open(const std::string& filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            ::close(fd);
+            return false;
+        }
+
+        MappedFile mapped;
+        mapped.len = st.st_size;
+        if (mapped.len > 0) {
+            mapped.ptr
+                = ::mmap(nullptr, mapped.len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped.ptr == MAP_FAILED) {
+                mapped.ptr = nullptr;
+                ::close(fd);
+                return false;
+            }
         }
+        ::close(fd);
+
+        *this = std::move(mapped);
+        return true;
+    }
+
+    std::string_view data() const
+    {
+        return { static_cast<const char*>(ptr), len };
+    }
+
+private:
+    void* ptr {};
+    usz len {};
+};
+
+#if DEQ_STATS
+// Counters bumped by `interpret()`, the deque keeps its own peak size
+struct Stats {
+    u64 instructions {};
+    usz peak_calls {};
+};
+#endif
+
+// Everything a run mutates
+struct Machine {
+    explicit Machine(usz call_depth)
+        : callstack(call_depth)
+    {
+    }
+
+    // Makes the machine ready for the next run in O(1) except for the values
+    // left on the deque
+    void reset()
+    {
+        deq.clear();
+        callstack.clear();
+        arena.reset();
+        inverted = false;
+        ip = 0;
+        restored = MappedFile();
+    }
+
+    Deque deq;
+    CallStack callstack;
+    Arena arena;
+    bool inverted = false;
+    usz ip = 0;
+    // Snapshot the machine was restored from, its strings point into it
+    MappedFile restored;
+#if DEQ_STATS
+    // Not cleared by `reset()`, they cover every run of the machine
+    Stats stats;
+#endif
+};
+
+struct StringHash {
+    using is_transparent = void;
+    usz operator()(std::string_view s) const
+    {
+        return std::hash<std::string_view> {}(s);
+    }
+};
+
+using Labels
+    = std::unordered_map<std::string, usz, StringHash, std::equal_to<>>;
+
+static std::optional<std::string> read_file(const std::string& filename)
+{
+    std::ifstream infile { filename };
+    if (!infile.is_open()) {
+        std::cerr << "[ERR] Failed to open file '" << filename
+                  << "': " << std::strerror(errno) << '\n';
+        return {};
+    }
+
+    std::stringstream buffer;
+    buffer << infile.rdbuf();
+    return buffer.str();
+}
+
+class Lexer {
+public:
+    Lexer(std::string filename, std::string src)
+        : source(std::move(src))
+    {
+        loc = Location { filename, 0, 0 };
 
-        std::stringstream buffer;
-        buffer << infile.rdbuf();
-        source = buffer.str();
         if (source.size() == 0) {
             std::cerr << "[WRN] File '" << filename << "' is empty\n";
         }
@@ -253,12 +934,12 @@ std::vector<Token> Lexer::lex()
 #define ERRT(token, msg)                                                       \
     std::cerr << std::endl << token.loc << ": [ERR] " << msg << '\n'
 
-static void trace(const std::deque<deq_t>& deq)
+static void trace(const Deque& deq)
 {
-    for (const auto& v : deq) {
+    deq.for_each([](const deq_t& v) {
         std::cout << v << "(" << human(v.type) << ")"
                   << " ";
-    }
+    });
     std::cout << '\n';
 }
 
@@ -297,54 +978,846 @@ static bool diag(std::optional<TypecheckResult> r, Token token)
 #define DIAG(v)                                                                \
     do {                                                                       \
         if (!diag(v, token)) {                                                 \
-            std::exit(1);                                                      \
+            FAIL(Type);                                                        \
         }                                                                      \
     } while (0)
 
-static void interpret(const std::vector<Token>& tox, bool debug = false)
+static Labels resolve_labels(const std::vector<Token>& tox)
 {
-    std::deque<deq_t> deq;
-    std::vector<std::tuple<usz, bool>> callstack;
-    std::unordered_map<std::string, usz> labels;
-    bool inverted = false;
-
-    {
-        usz i = 0;
-        for (const auto& token : tox) {
-            const auto& tok = token.text;
+    Labels labels;
 
-            if (tok.back() == ':') {
-                const auto& word = tok.substr(0, tok.size() - 1);
+    usz i = 0;
+    for (const auto& token : tox) {
+        const auto& tok = token.text;
 
-                if (labels.contains(word)) {
-                    ERR("label '" << word << "' is already defined!");
-                }
+        if (tok.back() == ':') {
+            const auto& word = tok.substr(0, tok.size() - 1);
 
-                labels.insert({ word, i });
+            if (labels.contains(word)) {
+                ERR("label '" << word << "' is already defined!");
             }
 
-            i++;
+            labels.insert({ word, i });
         }
+
+        i++;
     }
 
-    for (usz i = 0; i < tox.size();) {
-        const auto& token = tox.at(i);
-        const auto& tok = token.text;
-        bool left = false;
+    return labels;
+}
 
-        if (tok == "trace") {
+struct Word {
+    std::string_view text;
+    bool left;
+};
+
+// nullopt for labels and for words without a direction
+static std::optional<Word> split_direction(const Token& token)
+{
+    std::string_view tok = token.text;
+    if (tok.size() < 2 || tok.back() == ':') {
+        return {};
+    }
+
+    if (tok.front() == '!') {
+        return Word { tok.substr(1), true };
+    } else if (tok.back() == '!') {
+        return Word { tok.substr(0, tok.size() - 1), false };
+    }
+
+    return {};
+}
+
+// Reads integer and real literals the same way `interpret` does
+static std::optional<Value::As> numeric_literal(std::string_view word)
+{
+    if (word.front() != '-' && !std::isdigit(word.front())) {
+        return {};
+    }
+
+    if (word.back() == 'f') {
+        if (auto real = parse_number<f64>(word.substr(0, word.size() - 1))) {
+            return *real;
+        }
+    } else if (auto num = parse_number<s64>(word)) {
+        return *num;
+    }
+
+    return {};
+}
+
+static std::optional<Token> literal_token(
+    const Location& loc, const Value::As& v, bool left)
+{
+    NumberBuffer buf;
+    std::string text;
+    if (auto* num = std::get_if<s64>(&v)) {
+        text = format_number(buf, *num);
+    } else if (auto* real = std::get_if<f64>(&v);
+               real && std::isfinite(*real)) {
+        text = std::string(format_number(buf, *real)) + 'f';
+    } else {
+        return {};
+    }
+
+    return Token { loc, left ? '!' + text : text + '!' };
+}
+
+// `below op top` as the interpreter computes it, nullopt if it fails at
+// runtime or is left to the runtime to diagnose
+template <typename T>
+static std::optional<Value::As> fold_binary(std::string_view op, T below, T top)
+{
+    if (op == "add" || op == "sub" || op == "mul") {
+        if constexpr (std::is_same_v<T, s64>) {
+            // Wraps around like the interpreter does in practice
+            u64 a = below, b = top;
+            u64 r = op == "add" ? a + b : op == "sub" ? a - b : a * b;
+            return static_cast<s64>(r);
+        } else {
+            return op == "add" ? below + top
+                : op == "sub"  ? below - top
+                               : below * top;
+        }
+    } else if (op == "div") {
+        if constexpr (std::is_same_v<T, s64>) {
+            if (top == 0 || (below == INT64_MIN && top == -1)) {
+                return {};
+            }
+        }
+        return below / top;
+    } else if (op == "eq") {
+        return static_cast<s64>(below == top);
+    } else if (op == "neq") {
+        return static_cast<s64>(below != top);
+    }
+
+    if constexpr (std::is_same_v<T, s64>) {
+        if (op == "mod") {
+            if (top == 0 || (below == INT64_MIN && top == -1)) {
+                return {};
+            }
+            return below % top;
+        } else if (op == "lt") {
+            return static_cast<s64>(below < top);
+        } else if (op == "lteq") {
+            return static_cast<s64>(below <= top);
+        } else if (op == "gt") {
+            return static_cast<s64>(below > top);
+        } else if (op == "gteq") {
+            return static_cast<s64>(below >= top);
+        } else if (op == "and") {
+            return static_cast<s64>(below && top);
+        } else if (op == "or") {
+            return static_cast<s64>(below || top);
+        }
+    }
+
+    return {};
+}
+
+static std::optional<Value::As> fold_unary(std::string_view op, s64 v)
+{
+    if (op == "not") {
+        return static_cast<s64>(!v);
+    } else if (op == "bnot") {
+        return ~v;
+    }
+
+    return {};
+}
+
+// Tries to fold the tail of `out`. All the folded words must share a
+// direction, then they work on the same end of the deque whatever the
+// `inverted` flag is at runtime
+static bool fold_tail(std::vector<Token>& out,
+    const std::unordered_set<std::string_view>& labels)
+{
+    usz n = out.size();
+    if (n < 2) {
+        return false;
+    }
+
+    auto op = split_direction(out.at(n - 1));
+    auto a = split_direction(out.at(n - 2));
+    if (!op || !a || a->left != op->left) {
+        return false;
+    }
+
+    auto drop = [&out](usz count) {
+        for (usz i = 0; i < count; i++) {
+            out.pop_back();
+        }
+    };
+
+    auto replace = [&out, &drop](usz count, std::optional<Token> with) {
+        if (!with) {
+            return false;
+        }
+        drop(count);
+        out.push_back(*with);
+        return true;
+    };
+
+    auto va = numeric_literal(a->text);
+    if (va && std::holds_alternative<s64>(*va)) {
+        if (auto r = fold_unary(op->text, std::get<s64>(*va))) {
+            return replace(2, literal_token(out.back().loc, *r, op->left));
+        }
+    }
+
+    if (n < 3) {
+        return false;
+    }
+
+    auto b = split_direction(out.at(n - 3));
+    if (!b || b->left != op->left) {
+        return false;
+    }
+    auto vb = numeric_literal(b->text);
+
+    if (op->text == "jz" || op->text == "jnz") {
+        if (!vb || !std::holds_alternative<s64>(*vb)
+            || !labels.contains(a->text)) {
+            return false;
+        }
+
+        bool taken = (std::get<s64>(*vb) == 0) == (op->text == "jz");
+        if (!taken) {
+            drop(3);
+            return true;
+        }
+
+        Token addr = out.at(n - 2);
+        Token jmp { out.back().loc, op->left ? "!jmp" : "jmp!" };
+        drop(3);
+        out.push_back(addr);
+        out.push_back(jmp);
+        return true;
+    }
+
+    if (!va || !vb || va->index() != vb->index()) {
+        return false;
+    }
+
+    std::optional<Value::As> r;
+    if (auto* below = std::get_if<s64>(&*vb)) {
+        r = fold_binary(op->text, *below, std::get<s64>(*va));
+    } else {
+        r = fold_binary(op->text, std::get<f64>(*vb), std::get<f64>(*va));
+    }
+    if (!r) {
+        return false;
+    }
+
+    return replace(3, literal_token(out.back().loc, *r, op->left));
+}
+
+static bool is_terminator(const Token& token)
+{
+    if (token.text == "exit" || token.text == "ret") {
+        return true;
+    }
+
+    auto word = split_direction(token);
+    return word && word->text == "jmp";
+}
+
+// Folds constant arithmetic, comparisons and conditional jumps, then drops
+// whatever follows an unconditional jump, `ret` or `exit` up to the next
+// label. The code moves, so jumps are expected to target labels only
+static std::vector<Token> optimize(const std::vector<Token>& tox)
+{
+    std::unordered_set<std::string_view> labels;
+    for (const auto& token : tox) {
+        std::string_view tok = token.text;
+        if (tok.back() == ':') {
+            labels.insert(tok.substr(0, tok.size() - 1));
+        }
+    }
+
+    std::vector<Token> out;
+    bool dead = false;
+    for (const auto& token : tox) {
+        if (token.text.back() == ':') {
+            dead = false;
+        }
+        if (dead) {
+            continue;
+        }
+
+        out.push_back(token);
+        while (fold_tail(out, labels)) { }
+        dead = !out.empty() && is_terminator(out.back());
+    }
+
+    return out;
+}
+
+static void dump_ir(const std::vector<Token>& tox, std::string_view title)
+{
+    std::cout << "; " << title << ": " << tox.size() << " tokens\n";
+    for (usz i = 0; i < tox.size(); i++) {
+        const auto& token = tox.at(i);
+        std::cout << i << '\t' << token.text << "\t; " << token.loc << '\n';
+    }
+}
+
+static constexpr u64 FNV_OFFSET = 0xcbf29ce484222325;
+
+static u64 fnv1a(std::string_view data, u64 hash = FNV_OFFSET)
+{
+    for (char c : data) {
+        hash ^= static_cast<u8>(c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static void write_u64(std::ostream& os, u64 v)
+{
+    os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static void write_str(std::ostream& os, std::string_view s)
+{
+    write_u64(os, s.size());
+    os.write(s.data(), s.size());
+}
+
+// Reads back what `write_u64` and `write_str` wrote. Reading past the end
+// fails and leaves the reader failed
+class ByteReader {
+public:
+    explicit ByteReader(std::string_view data)
+        : data(data)
+    {
+    }
+
+    bool read(u64& v)
+    {
+        if (failed || data.size() < sizeof(v)) {
+            failed = true;
+            return false;
+        }
+        std::memcpy(&v, data.data(), sizeof(v));
+        data.remove_prefix(sizeof(v));
+        return true;
+    }
+
+    bool read(std::string_view& s)
+    {
+        u64 size;
+        if (!read(size) || data.size() < size) {
+            failed = true;
+            return false;
+        }
+        s = data.substr(0, size);
+        data.remove_prefix(size);
+        return true;
+    }
+
+    bool ok() const { return !failed; }
+    bool done() const { return data.empty(); }
+
+private:
+    std::string_view data;
+    bool failed = false;
+};
+
+// Compiled form of a single file: its tokens with `include` directives taken
+// out, and its labels relative to the first token
+struct Unit {
+    std::vector<Token> tox;
+    std::vector<Token> includes;
+    Labels labels;
+};
+
+// Whole program ready to run, the script followed by every module it pulls in
+struct Program {
+    std::vector<Token> tox;
+    Labels labels;
+    // Paths of the script and every module linked into it
+    std::vector<std::string> files;
+};
+
+// Prefixes the labels defined in a module, and the uses of them, with
+// `ns.`, so the same label names can be used in different modules
+static void namespace_labels(std::vector<Token>& tox, std::string_view ns)
+{
+    std::unordered_set<std::string> local;
+    for (const auto& token : tox) {
+        if (token.text.back() == ':') {
+            local.insert(token.text.substr(0, token.text.size() - 1));
+        }
+    }
+
+    std::string prefix = std::string(ns) + '.';
+    for (auto& token : tox) {
+        if (token.text.back() == ':') {
+            token.text = prefix + token.text;
+        } else if (auto word = split_direction(token);
+                   word && local.contains(std::string(word->text))) {
+            token.text = word->left ? '!' + prefix + std::string(word->text)
+                                    : prefix + std::string(word->text) + '!';
+        }
+    }
+}
+
+// Compilation errors are reported and result in nullopt, so that a server
+// outlives the scripts that fail to compile
+static std::optional<Unit> compile_unit(
+    const std::string& path, std::string source, std::string_view ns,
+    int opt_level)
+{
+    Lexer l(path, std::move(source));
+    auto tox = l.lex();
+
+    Unit unit;
+    std::vector<Token> body;
+    for (usz i = 0; i < tox.size(); i++) {
+        const auto& token = tox.at(i);
+        if (token.text != "include") {
+            body.push_back(token);
+            continue;
+        }
+
+        if (i + 1 >= tox.size() || tox.at(i + 1).text.size() < 2
+            || tox.at(i + 1).text.front() != '"'
+            || tox.at(i + 1).text.back() != '"') {
+            ERR("include expects a file name in double quotes");
+            return {};
+        }
+        const auto& name = tox.at(++i);
+        unit.includes.push_back(
+            { name.loc, name.text.substr(1, name.text.size() - 2) });
+    }
+
+    if (!ns.empty()) {
+        namespace_labels(body, ns);
+    }
+    if (opt_level > 0) {
+        body = optimize(body);
+    }
+
+    unit.labels = resolve_labels(body);
+    unit.tox = std::move(body);
+    return unit;
+}
+
+static constexpr std::string_view UNIT_MAGIC = "DEQUNIT";
+// Written after the magic. Bump it whenever the unit format or the code
+// produced by `compile_unit()` and `optimize()` changes, so units cached by an
+// older deq are compiled again instead of reused
+static constexpr u64 UNIT_VERSION = 3;
+
+static void write_unit(const std::filesystem::path& file, const Unit& unit)
+{
+    // Written aside and renamed, so concurrent runs never see half a unit
+    auto tmp = file;
+    tmp += ".tmp" + std::to_string(::getpid());
+
+    {
+        std::ofstream out { tmp, std::ios::binary };
+        out.write(UNIT_MAGIC.data(), UNIT_MAGIC.size());
+        write_u64(out, UNIT_VERSION);
+        for (const auto* tox : { &unit.tox, &unit.includes }) {
+            write_u64(out, tox->size());
+            for (const auto& token : *tox) {
+                write_u64(out, token.loc.row);
+                write_u64(out, token.loc.col);
+                write_str(out, token.text);
+            }
+        }
+        if (!out) {
+            return;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, file, ec);
+}
+
+static std::optional<Unit> read_unit(
+    const std::filesystem::path& file, const std::string& path)
+{
+    std::ifstream infile { file, std::ios::binary };
+    if (!infile.is_open()) {
+        return {};
+    }
+    std::stringstream buffer;
+    buffer << infile.rdbuf();
+    auto data = buffer.str();
+
+    if (!std::string_view(data).starts_with(UNIT_MAGIC)) {
+        return {};
+    }
+
+    Unit unit;
+    ByteReader r(std::string_view(data).substr(UNIT_MAGIC.size()));
+    u64 version = 0;
+    if (!r.read(version) || version != UNIT_VERSION) {
+        return {};
+    }
+    for (auto* tox : { &unit.tox, &unit.includes }) {
+        u64 count = 0;
+        r.read(count);
+        for (u64 i = 0; i < count && r.ok(); i++) {
+            u64 row = 0, col = 0;
+            std::string_view text;
+            if (r.read(row) && r.read(col) && r.read(text)) {
+                tox->push_back({ { path, col, row }, std::string(text) });
+            }
+        }
+    }
+    if (!r.ok() || !r.done()) {
+        return {};
+    }
+
+    unit.labels = resolve_labels(unit.tox);
+    return unit;
+}
+
+// Compiled modules by content hash, kept for the life of the process and,
+// with a cache directory, on disk between runs
+class ModuleCache {
+public:
+    explicit ModuleCache(std::optional<std::filesystem::path> dir)
+        : dir(std::move(dir))
+    {
+        if (this->dir) {
+            std::error_code ec;
+            std::filesystem::create_directories(*this->dir, ec);
+        }
+    }
+
+    // nullptr if the module cannot be compiled
+    const Unit* load(const std::string& path, std::string_view ns,
+        int opt_level)
+    {
+        auto source = read_file(path);
+        if (!source) {
+            return nullptr;
+        }
+        u64 key = fnv1a(*source, fnv1a(ns, FNV_OFFSET + opt_level));
+
+        if (auto unit = units.find(key); unit != units.end()) {
+            return &unit->second;
+        }
+
+        std::optional<Unit> unit;
+        std::filesystem::path file;
+        if (dir) {
+            NumberBuffer buf;
+            auto [end, ec] = std::to_chars(
+                buf.data(), buf.data() + buf.size(), key, 16);
+            (void)ec;
+            file = *dir / (std::string(buf.data(), end) + ".deqc");
+            unit = read_unit(file, path);
+        }
+        if (!unit) {
+            unit = compile_unit(path, std::move(*source), ns, opt_level);
+            if (!unit) {
+                return nullptr;
+            }
+            if (dir) {
+                write_unit(file, *unit);
+            }
+        }
+
+        return &units.emplace(key, std::move(*unit)).first->second;
+    }
+
+private:
+    std::optional<std::filesystem::path> dir;
+    std::unordered_map<u64, Unit> units;
+};
+
+// Appends `unit` to the program moving its labels after the code that is
+// already there
+static bool append_unit(Program& prog, const Unit& unit)
+{
+    usz base = prog.tox.size();
+    for (const auto& [name, i] : unit.labels) {
+        const auto& token = unit.tox.at(i);
+        if (auto first = prog.labels.find(name); first != prog.labels.end()) {
+            ERR("label '" << name << "' is already defined!");
+            const auto& other = prog.tox.at(first->second);
+            NOTET(other, "first defined here");
+            if (other.loc.filename != token.loc.filename) {
+                NOTE("modules are namespaced by file name, so '"
+                    << other.loc.filename << "' and '" << token.loc.filename
+                    << "' cannot both be included");
+            }
+            return false;
+        }
+        prog.labels.insert({ name, base + i });
+    }
+    prog.tox.reserve(base + unit.tox.size());
+    for (const auto& token : unit.tox) {
+        prog.tox.push_back(token);
+    }
+    return true;
+}
+
+// Modules are linked once each, in the order they are first included. Their
+// labels are available as `<file name without extension>.<label>`
+static bool link_includes(Program& prog, const Unit& unit,
+    const std::filesystem::path& dir, ModuleCache& cache, int opt_level,
+    std::unordered_set<std::string>& linked)
+{
+    for (const auto& include : unit.includes) {
+        auto path = (dir / include.text).lexically_normal();
+        std::error_code ec;
+        auto canonical = std::filesystem::weakly_canonical(path, ec);
+        if (!linked.insert((ec ? path : canonical).string()).second) {
+            continue;
+        }
+
+        prog.files.push_back(path.string());
+        const auto* module = cache.load(
+            path.string(), path.stem().string(), opt_level);
+        if (module == nullptr || !append_unit(prog, *module)
+            || !link_includes(prog, *module, path.parent_path(), cache,
+                opt_level, linked)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::optional<Program> link(
+    const std::string& path, ModuleCache& cache, int opt_level)
+{
+    auto source = read_file(path);
+    if (!source) {
+        return {};
+    }
+    auto main = compile_unit(path, std::move(*source), "", opt_level);
+    if (!main) {
+        return {};
+    }
+
+    Program prog;
+    prog.files.push_back(path);
+    if (!append_unit(prog, *main)) {
+        return {};
+    }
+    if (main->includes.empty()) {
+        return prog;
+    }
+
+    // Do not fall through from the script into the modules
+    Token exit { Location { path, 0, 0 }, "exit" };
+    prog.tox.push_back(exit);
+
+    std::unordered_set<std::string> linked;
+    std::error_code ec;
+    linked.insert(std::filesystem::weakly_canonical(path, ec).string());
+    if (!link_includes(prog, *main, std::filesystem::path(path).parent_path(),
+            cache, opt_level, linked)) {
+        return {};
+    }
+
+    return prog;
+}
+
+// Changes whenever the code does, so a snapshot only resumes the program it
+// was taken from
+static u64 program_hash(const Program& prog)
+{
+    u64 hash = FNV_OFFSET;
+    for (const auto& token : prog.tox) {
+        hash = fnv1a(token.text, hash);
+        hash = fnv1a(std::string_view("\0", 1), hash);
+    }
+    return hash;
+}
+
+static constexpr std::string_view SNAPSHOT_MAGIC = "DEQSNAP1";
+
+// Everything is written in host byte order: snapshots are meant to be
+// restored on the machine they were taken on
+// Returns what went wrong on failure
+static std::optional<std::string> write_snapshot(
+    const std::string& filename, const Program& prog, const Machine& m)
+{
+    // Written aside and renamed: the machine may have been restored from
+    // `filename` and still read its strings from the mapping
+    auto tmp = filename + ".tmp" + std::to_string(::getpid());
+    std::ofstream out { tmp, std::ios::binary };
+    out.write(SNAPSHOT_MAGIC.data(), SNAPSHOT_MAGIC.size());
+    write_u64(out, program_hash(prog));
+    write_u64(out, m.ip);
+    write_u64(out, m.inverted);
+
+    write_u64(out, m.callstack.size());
+    for (const auto& frame : m.callstack) {
+        write_u64(out, frame.ret);
+        write_u64(out, frame.left);
+    }
+
+    // Values are restored with their token looked up by index, so values that
+    // do not come from the program, like input values, cannot be saved
+    const Token* foreign = nullptr;
+    write_u64(out, m.deq.size());
+    m.deq.for_each([&out, &prog, &foreign](const deq_t& v) {
+        write_u64(out, static_cast<u64>(v.type));
+        std::less<const Token*> before;
+        if (before(&v.tok, prog.tox.data())
+            || !before(&v.tok, prog.tox.data() + prog.tox.size())) {
+            foreign = foreign != nullptr ? foreign : &v.tok;
+            write_u64(out, 0);
+        } else {
+            write_u64(out, &v.tok - prog.tox.data());
+        }
+        if (auto* num = std::get_if<s64>(&v.as)) {
+            write_u64(out, *num);
+        } else if (auto* real = std::get_if<f64>(&v.as)) {
+            u64 bits;
+            std::memcpy(&bits, real, sizeof(bits));
+            write_u64(out, bits);
+        } else {
+            write_str(out, std::get<std::string_view>(v.as));
+        }
+    });
+
+    out.close();
+    if (foreign != nullptr) {
+        std::remove(tmp.c_str());
+        std::ostringstream error;
+        error << "value from " << foreign->loc
+              << " does not come from the program";
+        return error.str();
+    }
+    if (!out || std::rename(tmp.c_str(), filename.c_str()) < 0) {
+        std::string error = std::strerror(errno);
+        std::remove(tmp.c_str());
+        return error;
+    }
+    return {};
+}
+
+// The snapshot stays mapped for the run, restored strings point into it
+static void restore_snapshot(
+    const std::string& filename, const Program& prog, Machine& m)
+{
+    if (!m.restored.open(filename)) {
+        std::cerr << "[ERR] Failed to open snapshot '" << filename
+                  << "': " << std::strerror(errno) << '\n';
+        FAIL(Snapshot);
+    }
+
+    auto data = m.restored.data();
+    if (!data.starts_with(SNAPSHOT_MAGIC)) {
+        std::cerr << "[ERR] '" << filename << "' is not a snapshot\n";
+        FAIL(Snapshot);
+    }
+
+    ByteReader r(data.substr(SNAPSHOT_MAGIC.size()));
+    u64 hash = 0, ip = 0, inverted = 0, frames = 0, values = 0;
+    r.read(hash);
+    if (r.ok() && hash != program_hash(prog)) {
+        std::cerr << "[ERR] Snapshot '" << filename
+                  << "' was taken from a different program\n";
+        FAIL(Snapshot);
+    }
+    r.read(ip);
+    r.read(inverted);
+    m.ip = ip;
+    m.inverted = inverted;
+
+    r.read(frames);
+    for (u64 i = 0; i < frames && r.ok(); i++) {
+        u64 ret = 0, left = 0;
+        r.read(ret);
+        r.read(left);
+        if (!m.callstack.push({ ret, static_cast<bool>(left) })) {
+            std::cerr << "[ERR] Snapshot '" << filename << "' has more than "
+                      << m.callstack.capacity() << " nested calls\n";
+            FAIL(Snapshot);
+        }
+    }
+
+    r.read(values);
+    for (u64 i = 0; i < values && r.ok(); i++) {
+        u64 type = 0, tok = 0, bits = 0;
+        std::string_view str;
+        if (!r.read(type) || !r.read(tok) || tok >= prog.tox.size()) {
+            break;
+        }
+        const auto& token = prog.tox.at(tok);
+
+        switch (static_cast<Value::Type>(type)) {
+        case Value::Type::Integer:
+            r.read(bits);
+            m.deq.push_back({ token, static_cast<s64>(bits) });
+            break;
+        case Value::Type::Real: {
+            r.read(bits);
+            f64 real;
+            std::memcpy(&real, &bits, sizeof(real));
+            m.deq.push_back({ token, real });
+        } break;
+        case Value::Type::String:
+            r.read(str);
+            m.deq.push_back({ token, str });
+            break;
+        default:
+            r.read(str); // Fails the reader below
+        }
+    }
+
+    if (!r.ok() || !r.done() || m.deq.size() != values
+        || m.ip > prog.tox.size()) {
+        std::cerr << "[ERR] Snapshot '" << filename << "' is corrupted\n";
+        FAIL(Snapshot);
+    }
+}
+
+static void interpret(const Program& prog, Machine& m, const Options& opts)
+{
+    const auto& tox = prog.tox;
+    const auto& labels = prog.labels;
+    auto& deq = m.deq;
+    auto& callstack = m.callstack;
+    auto& inverted = m.inverted;
+    DequeEnds ends(deq);
+#if DEQ_STATS
+    auto& stats = m.stats;
+#endif
+    STAT(stats.peak_calls = std::max(stats.peak_calls, callstack.size()));
+
+    for (usz i = m.ip; i < tox.size();) {
+        const auto& token = tox.at(i);
+        const auto& tok = token.text;
+        bool left = false;
+        STAT(stats.instructions++);
+
+        if (tok == "trace") {
+            ends.flush();
             trace(deq);
 
             i++;
             continue;
+        } else if (tok == "snapshot") {
+            i++;
+            m.ip = i;
+            ends.flush();
+            if (auto error = write_snapshot(opts.snapshot_path, prog, m)) {
+                ERR("could not write snapshot '" << opts.snapshot_path
+                                                 << "': " << *error);
+                FAIL(Snapshot);
+            }
+            continue;
         } else if (tok == "ret") {
             if (callstack.size() < 1) {
                 ERR("cannot return: call stack is empty!");
-                std::exit(1);
+                FAIL(CallStack);
             }
 
-            i = std::get<0>(callstack.back()) + 1;
-            callstack.pop_back();
+            i = callstack.pop().ret + 1;
             continue;
         } else if (tok == "exit") {
             break;
@@ -352,21 +1825,21 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
 
         if (tok.size() < 2) {
             ERR("token of size less than 2 is impossible!");
-            std::exit(1);
+            FAIL(Syntax);
         }
 
         if (tok.front() != '!' && tok.back() != '!' && tok.back() != ':') {
             ERR("not a label and no direction specified!");
-            std::exit(1);
+            FAIL(Syntax);
         }
         if (tok.back() == ':' && tok.front() == '!') {
             ERR("label cannot contain direction specifier! Consider removing "
                 "'!', if "
                 "it is a label.");
-            std::exit(1);
+            FAIL(Syntax);
         }
 
-        auto word = tok;
+        std::string_view word = tok;
         if (tok.back() == ':') {
             i++;
             continue;
@@ -378,44 +1851,40 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             word = word.substr(0, word.size() - 1);
         }
 
-        auto push = [left, inverted, &deq](deq_t v) {
-            bool dir = inverted ? !left : left;
-            if (dir) {
-                deq.push_front(v);
-            } else {
-                deq.push_back(v);
-            }
+        auto push = [&left, &inverted, &ends](deq_t v) {
+            ends.push(v, inverted ? !left : left);
         };
 
-        auto pop = [left, inverted, &deq]() -> deq_t {
-            bool dir = inverted ? !left : left;
-            if (dir) {
-                deq_t ret = deq.front();
-                deq.pop_front();
-                return ret;
-            } else {
-                deq_t ret = deq.back();
-                deq.pop_back();
-                return ret;
-            }
+        auto pop = [left, &inverted, &ends]() -> deq_t {
+            return ends.pop(inverted ? !left : left);
         };
 
-        auto expect = [&deq, &token](usz n) {
-            if (deq.size() < n) {
+        auto expect = [&ends, &token](usz n) {
+            if (ends.size() < n) {
                 ERR("expected to have at least " << n
                                                  << " elements on the deq");
-                std::exit(1);
+                FAIL(Underflow);
             }
         };
 
         using enum Value::Type;
         if ((word.front() == '-' && word.back() == 'f')
             || (std::isdigit(word.front()) && word.back() == 'f')) {
-            push({ token, static_cast<f64>(std::stod(word)) });
+            auto real = parse_number<f64>(word.substr(0, word.size() - 1));
+            if (!real) {
+                ERR("invalid real literal");
+                FAIL(Syntax);
+            }
+            push({ token, *real });
 
             i++;
         } else if (word.front() == '-' || std::isdigit(word.front())) {
-            push({ token, static_cast<s64>(std::stoll(word)) });
+            auto num = parse_number<s64>(word);
+            if (!num) {
+                ERR("invalid integer literal");
+                FAIL(Syntax);
+            }
+            push({ token, *num });
 
             i++;
         } else if (word.front() == '"' && word.back() == '"') {
@@ -480,7 +1949,7 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             } else {
                 ERR("expected two " << human(Integer, true) << " or two "
                                     << human(Real, true));
-                std::exit(1);
+                FAIL(Type);
             }
 
             i++;
@@ -497,7 +1966,7 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             } else {
                 ERR("expected two " << human(Integer, true) << " or two "
                                     << human(Real, true));
-                std::exit(1);
+                FAIL(Type);
             }
 
             i++;
@@ -516,7 +1985,7 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             } else {
                 ERR("expected two " << human(Integer, true) << " or two "
                                     << human(Real, true));
-                std::exit(1);
+                FAIL(Type);
             }
 
             i++;
@@ -535,7 +2004,7 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             } else {
                 ERR("expected two " << human(Integer, true) << " or two "
                                     << human(Real, true));
-                std::exit(1);
+                FAIL(Type);
             }
 
             i++;
@@ -603,8 +2072,8 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             } else if (v1.type == String || v2.type == String) {
                 DIAG(typecheck<2>({ v1, v2 }, { String, String }));
                 push({ token,
-                    static_cast<s64>(std::get<std::string>(v1.as)
-                        == std::get<std::string>(v2.as)) });
+                    static_cast<s64>(std::get<std::string_view>(v1.as)
+                        == std::get<std::string_view>(v2.as)) });
             }
 
             i++;
@@ -625,8 +2094,8 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             } else if (v1.type == String || v2.type == String) {
                 DIAG(typecheck<2>({ v1, v2 }, { String, String }));
                 push({ token,
-                    static_cast<s64>(std::get<std::string>(v1.as)
-                        != std::get<std::string>(v2.as)) });
+                    static_cast<s64>(std::get<std::string_view>(v1.as)
+                        != std::get<std::string_view>(v2.as)) });
             }
 
             i++;
@@ -708,156 +2177,899 @@ static void interpret(const std::vector<Token>& tox, bool debug = false)
             deq_t v = pop();
             DIAG(typecheck<1>({ v }, { Integer }));
 
-            callstack.push_back({ i, left });
-            i = std::get<s64>(v.as);
-        } else if (word == "jz") {
-            expect(2);
-            deq_t addr = pop();
-            deq_t v = pop();
-            DIAG(typecheck<2>({ v, addr }, { Integer, Integer }));
+            // `call` right before `ret` is a tail call: the callee returns
+            // straight to our caller, so the current frame is reused
+            auto* frame = callstack.top();
+            if (frame != nullptr && i + 1 < tox.size()
+                && tox.at(i + 1).text == "ret") {
+                frame->left = left;
+            } else if (!callstack.push({ i, left })) {
+                ERR("call stack overflow: more than " << callstack.capacity()
+                                                      << " nested calls");
+                NOTE("call depth can be changed with --call-depth");
+                FAIL(CallStack);
+            }
+            STAT(stats.peak_calls
+                = std::max(stats.peak_calls, callstack.size()));
+            i = std::get<s64>(v.as);
+        } else if (word == "jz") {
+            expect(2);
+            deq_t addr = pop();
+            deq_t v = pop();
+            DIAG(typecheck<2>({ v, addr }, { Integer, Integer }));
+
+            if (std::get<s64>(v.as) == 0) {
+                i = std::get<s64>(addr.as);
+            } else {
+                i++;
+            }
+        } else if (word == "jnz") {
+            expect(2);
+            deq_t addr = pop();
+            deq_t v = pop();
+
+            DIAG(typecheck<2>({ v, addr }, { Integer, Integer }));
+
+            if (std::get<s64>(v.as) != 0) {
+                i = std::get<s64>(addr.as);
+            } else {
+                i++;
+            }
+        } else if (word == "print") {
+            expect(1);
+            deq_t v = pop();
+            std::cout << v;
+
+            i++;
+        } else if (word == "println") {
+            expect(1);
+            deq_t v = pop();
+            std::cout << v << '\n';
+
+            i++;
+        } else if (word == "putc") {
+            expect(1);
+            deq_t v = pop();
+            DIAG(typecheck<1>({ v }, { Integer }));
+            std::cout << static_cast<char>(std::get<s64>(v.as));
+
+            i++;
+        } else if (word == "calldir") {
+            auto* frame = callstack.top();
+            if (frame == nullptr) {
+                ERR("cannot get call direction: call stack is empty!");
+                FAIL(CallStack);
+            }
+            push({ token, static_cast<s64>(frame->left) });
+
+            i++;
+        } else if (word == "invertdir") {
+            // Pushed in the direction in effect before the flip
+            push({ token, static_cast<s64>(left) });
+            inverted = !inverted;
+
+            i++;
+        } else if (word == "setinverted") {
+            expect(1);
+            deq_t v = pop();
+            DIAG(typecheck<1>({ v }, { Integer }));
+            inverted = static_cast<bool>(std::get<s64>(v.as));
+
+            i++;
+        } else if (word == ">real") {
+            expect(1);
+            deq_t v = pop();
+
+            switch (v.type) {
+            case Integer:
+                DIAG(typecheck<1>({ v }, { Integer }));
+                push({ token, static_cast<f64>(std::get<s64>(v.as)) });
+                break;
+            case String: {
+                DIAG(typecheck<1>({ v }, { String }));
+                // Real literals may keep their `f` suffix: "1.5f"
+                auto text = std::get<std::string_view>(v.as);
+                if (text.ends_with('f')) {
+                    text.remove_suffix(1);
+                }
+                if (auto real = parse_number<f64>(text)) {
+                    push({ token, *real });
+                } else {
+                    ERRT(v.tok, "cannot convert string to " << human(Real));
+                    NOTE("for this operation");
+                    FAIL(Conversion);
+                }
+                break;
+            }
+            case Real:
+                ERR("expected " << human(Integer) << " or " << human(String));
+                FAIL(Type);
+                UNREACHABLE();
+            }
+
+            i++;
+        } else if (word == ">integer") {
+            expect(1);
+            deq_t v = pop();
+
+            switch (v.type) {
+            case Real:
+                DIAG(typecheck<1>({ v }, { Real }));
+                push({ token, static_cast<s64>(std::get<f64>(v.as)) });
+                break;
+            case String:
+                DIAG(typecheck<1>({ v }, { String }));
+                if (auto num
+                    = parse_number<s64>(std::get<std::string_view>(v.as))) {
+                    push({ token, *num });
+                } else {
+                    ERRT(v.tok, "cannot convert string to " << human(Integer));
+                    NOTE("for this operation");
+                    FAIL(Conversion);
+                }
+                break;
+            case Integer:
+                ERR("expected " << human(Real) << " or " << human(String));
+                FAIL(Type);
+                UNREACHABLE();
+            }
+
+            i++;
+        } else if (word == ">string") {
+            expect(1);
+            deq_t v = pop();
+            NumberBuffer buf;
+            switch (v.type) {
+            case Integer:
+                DIAG(typecheck<1>({ v },
+                    { Integer })); // NOTE: Is this really needed? <2025-05-24>
+                push({ token,
+                    m.arena.store(format_number(buf, std::get<s64>(v.as))) });
+                break;
+            case Real:
+                DIAG(typecheck<1>({ v },
+                    { Real })); // NOTE: Is this really needed? <2025-05-24>
+                push({ token,
+                    m.arena.store(format_number(buf, std::get<f64>(v.as))) });
+                break;
+            case String:
+                ERR("expected " << human(Integer) << " or " << human(Real));
+                FAIL(Type);
+                UNREACHABLE();
+            }
+
+            i++;
+        } else {
+            if (auto label = labels.find(word); label != labels.end()) {
+                push({ token, static_cast<s64>(label->second) });
+                i++;
+            } else {
+                ERR("unexpected token");
+                FAIL(Syntax);
+            }
+        }
+
+        if (opts.debug) {
+            std::cout << "\nCALLSTACK: ";
+            for (const auto& frame : callstack) {
+                std::cout << frame.ret;
+            }
+            std::cout << '\n';
+
+            std::cout << "DEQUE STATE(inverted: " << inverted << "): ";
+            ends.flush();
+            trace(deq);
+        }
+    }
+
+#if DEQ_STATS
+    if (opts.debug) {
+        auto stats = m.arena.stats();
+        std::cout << "\nARENA: " << stats.used << " bytes in "
+                  << stats.allocations << " allocations, high-water "
+                  << stats.high_water << " of " << stats.reserved
+                  << " bytes reserved\n";
+    }
+#endif
+
+    m.reset();
+}
+
+#if DEQ_STATS
+// Totals of the runs of a process, plain data so that server workers can send
+// theirs to the server
+struct StatsTotals {
+    u64 instructions = 0;
+    usz peak_deq = 0;
+    usz peak_calls = 0;
+    usz allocations = 0;
+    usz bytes = 0;
+    usz arena_high_water = 0;
+    f64 wall = 0;
+    f64 cpu = 0;
+    // Why the latest run stopped
+    Failure failure = Failure::None;
+
+    void merge(const StatsTotals& other)
+    {
+        instructions += other.instructions;
+        peak_deq = std::max(peak_deq, other.peak_deq);
+        peak_calls = std::max(peak_calls, other.peak_calls);
+        allocations += other.allocations;
+        bytes += other.bytes;
+        arena_high_water = std::max(arena_high_water, other.arena_high_water);
+        wall += other.wall;
+        cpu += other.cpu;
+        failure = other.failure;
+    }
+};
+
+static_assert(std::is_trivially_copyable_v<StatsTotals>);
+
+// Written to `--stats` at exit, which also covers runs stopped by an error.
+// Server workers send their totals to `sink` instead, and the server writes
+// the sum after every request
+struct StatsReport {
+    std::string path;
+    bool prometheus = false;
+    int sink = -1;
+    // Machine of the run in progress
+    const Machine* machine = nullptr;
+    std::chrono::steady_clock::time_point wall_start;
+    std::clock_t cpu_start = 0;
+    StatsTotals totals;
+};
+
+static StatsReport report;
+
+static void begin_stats(const Machine& m)
+{
+    report.machine = &m;
+    report.wall_start = std::chrono::steady_clock::now();
+    report.cpu_start = std::clock();
+}
+
+static void end_stats()
+{
+    if (report.machine == nullptr) {
+        return;
+    }
+
+    const auto& m = *report.machine;
+    auto arena = m.arena.stats();
+    StatsTotals run;
+    run.instructions = m.stats.instructions;
+    run.peak_deq = m.deq.peak();
+    run.peak_calls = m.stats.peak_calls;
+    run.allocations = arena.allocations;
+    run.bytes = arena.bytes;
+    run.arena_high_water = arena.high_water;
+    run.wall = std::chrono::duration<f64>(
+        std::chrono::steady_clock::now() - report.wall_start)
+                   .count();
+    run.cpu = static_cast<f64>(std::clock() - report.cpu_start)
+        / CLOCKS_PER_SEC;
+    run.failure = failure;
+    report.totals.merge(run);
+    report.machine = nullptr;
+}
+
+static std::string_view failure_name(Failure f)
+{
+    switch (f) {
+    case Failure::None:
+        return "none";
+    case Failure::Compile:
+        return "compile";
+    case Failure::Syntax:
+        return "syntax";
+    case Failure::Type:
+        return "type";
+    case Failure::Underflow:
+        return "underflow";
+    case Failure::CallStack:
+        return "callstack";
+    case Failure::Conversion:
+        return "conversion";
+    case Failure::Snapshot:
+        return "snapshot";
+    case Failure::Io:
+        return "io";
+    }
+    UNREACHABLE();
+}
+
+static void write_stats_json(std::ostream& os, const StatsTotals& t)
+{
+    os << "{\n"
+       << "  \"instructions\": " << t.instructions << ",\n"
+       << "  \"peak_deque_depth\": " << t.peak_deq << ",\n"
+       << "  \"peak_call_depth\": " << t.peak_calls << ",\n"
+       << "  \"string_allocations\": " << t.allocations << ",\n"
+       << "  \"string_bytes\": " << t.bytes << ",\n"
+       << "  \"arena_high_water_bytes\": " << t.arena_high_water << ",\n"
+       << "  \"exit_error\": \"" << failure_name(t.failure) << "\",\n"
+       << "  \"wall_seconds\": " << t.wall << ",\n"
+       << "  \"cpu_seconds\": " << t.cpu << "\n"
+       << "}\n";
+}
+
+static void write_stats_prometheus(std::ostream& os, const StatsTotals& t)
+{
+    auto metric = [&os](std::string_view name, std::string_view type,
+                      auto value) {
+        os << "# TYPE deq_" << name << ' ' << type << '\n'
+           << "deq_" << name << ' ' << value << '\n';
+    };
+    metric("instructions_total", "counter", t.instructions);
+    metric("peak_deque_depth", "gauge", t.peak_deq);
+    metric("peak_call_depth", "gauge", t.peak_calls);
+    metric("string_allocations_total", "counter", t.allocations);
+    metric("string_bytes_total", "counter", t.bytes);
+    metric("arena_high_water_bytes", "gauge", t.arena_high_water);
+    os << "# TYPE deq_exit_error gauge\n"
+       << "deq_exit_error{category=\"" << failure_name(t.failure) << "\"} "
+       << (t.failure != Failure::None) << '\n';
+    metric("wall_seconds", "gauge", t.wall);
+    metric("cpu_seconds", "gauge", t.cpu);
+}
+
+// Written aside and renamed, so a reader never sees half a report
+static void save_stats()
+{
+    auto tmp = report.path + ".tmp" + std::to_string(::getpid());
+    std::ofstream os(tmp, std::ios::trunc);
+    if (report.prometheus) {
+        write_stats_prometheus(os, report.totals);
+    } else {
+        write_stats_json(os, report.totals);
+    }
+    os.close();
+    if (!os || std::rename(tmp.c_str(), report.path.c_str()) < 0) {
+        std::remove(tmp.c_str());
+        std::cerr << "[ERR] Failed to write statistics to '" << report.path
+                  << "'\n";
+    }
+}
+
+// Registered with `std::atexit()` when `--stats` is given
+static void write_stats()
+{
+    end_stats();
+    if (failure != Failure::None) {
+        report.totals.failure = failure;
+    }
+
+    if (report.sink >= 0) {
+        // Pipe writes this small are atomic, records never interleave
+        (void)!::write(report.sink, &report.totals, sizeof(report.totals));
+        return;
+    }
+    save_stats();
+}
+#endif
+
+// Runs a linked program on a fresh machine with `inputs` pushed to the back of
+// the deque first
+static void run(const Program& prog, const std::vector<Token>& inputs,
+    const Options& opts)
+{
+    Machine m(opts.call_depth);
+    STAT(begin_stats(m));
+    if (opts.spill_block > 0) {
+        m.deq.spill_to_disk(opts.spill_block);
+    }
+    if (opts.restore_path) {
+        restore_snapshot(*opts.restore_path, prog, m);
+    }
+
+    for (const auto& input : inputs) {
+        std::string_view text = input.text;
+        if (auto num = numeric_literal(text)) {
+            if (auto* integer = std::get_if<s64>(&*num)) {
+                m.deq.push_back({ input, *integer });
+            } else {
+                m.deq.push_back({ input, std::get<f64>(*num) });
+            }
+        } else {
+            m.deq.push_back({ input, text.substr(1, text.size() - 2) });
+        }
+    }
+
+    interpret(prog, m, opts);
+    STAT(end_stats());
+}
+
+// Input values are written as literals: `42`, `1.5f` or `"text"`
+static bool valid_input(std::string_view text)
+{
+    if (text.empty()) {
+        return false;
+    }
+    if (text.size() >= 2 && text.front() == '"' && text.back() == '"') {
+        return true;
+    }
+    return numeric_literal(text).has_value();
+}
+
+static bool read_all(int fd, std::string& out)
+{
+    std::array<char, 4096> buf;
+    for (;;) {
+        ssize_t n = ::read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        out.append(buf.data(), n);
+    }
+}
+
+static bool write_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+static std::optional<sockaddr_un> socket_address(const std::string& path)
+{
+    sockaddr_un addr {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "[ERR] Socket path '" << path << "' is too long\n";
+        return {};
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+// Server protocol, one request per connection. The client sends the path of a
+// script followed by one input value per line and shuts down its side, within
+// `REQUEST_TIMEOUT`. The server replies with everything the script prints,
+// stdout and stderr, and then a single byte with its exit code.
+//
+// Linked programs are cached by path and the modification times of their
+// files. Every request runs in a child process forked from the server, so a
+// script exiting with an error cannot take the server down, and at most
+// `workers` of them run at once.
+class Server {
+public:
+    explicit Server(const Options& opts)
+        : opts(opts)
+        , modules(opts.cache_dir)
+    {
+    }
+
+    int serve(const std::string& path)
+    {
+        auto addr = socket_address(path);
+        if (!addr) {
+            return 1;
+        }
+
+        if (::pipe(children) < 0) {
+            std::cerr << "[ERR] Failed to create pipe: " << std::strerror(errno)
+                      << '\n';
+            return 1;
+        }
+        for (int fd : children) {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#if DEQ_STATS
+        // Workers send their statistics back through this pipe
+        if (!report.path.empty()) {
+            if (::pipe(reports) < 0) {
+                std::cerr << "[ERR] Failed to create pipe: "
+                          << std::strerror(errno) << '\n';
+                return 1;
+            }
+            ::fcntl(reports[0], F_SETFL,
+                ::fcntl(reports[0], F_GETFL) | O_NONBLOCK);
+            for (int fd : reports) {
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+#endif
+        std::signal(SIGPIPE, SIG_IGN);
+        std::signal(SIGCHLD, on_child_exit);
+
+        listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        ::unlink(path.c_str());
+        if (listener < 0
+            || ::bind(listener, reinterpret_cast<sockaddr*>(&*addr),
+                   sizeof(*addr))
+                < 0
+            || ::listen(listener, SOMAXCONN) < 0) {
+            std::cerr << "[ERR] Failed to listen on '" << path
+                      << "': " << std::strerror(errno) << '\n';
+            return 1;
+        }
 
-            if (std::get<s64>(v.as) == 0) {
-                i = std::get<s64>(addr.as);
-            } else {
-                i++;
+        usz workers = opts.workers > 0 ? opts.workers
+                                       : std::max<long>(
+                                             ::sysconf(_SC_NPROCESSORS_ONLN), 1);
+        for (;;) {
+            while (!ready.empty() && running.size() < workers) {
+                auto [conn, request] = std::move(ready.front());
+                ready.pop_front();
+                handle(conn, request);
             }
-        } else if (word == "jnz") {
-            expect(2);
-            deq_t addr = pop();
-            deq_t v = pop();
 
-            DIAG(typecheck<2>({ v, addr }, { Integer, Integer }));
+            // Stop accepting while every worker is busy
+            bool accepting = running.size() < workers;
+            std::vector<pollfd> fds {
+                { children[0], POLLIN, 0 },
+                { listener, static_cast<short>(accepting ? POLLIN : 0), 0 },
+            };
+            for (const auto& [conn, _] : pending) {
+                fds.push_back({ conn, POLLIN, 0 });
+            }
+            if (::poll(fds.data(), fds.size(), next_timeout()) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "[ERR] poll: " << std::strerror(errno) << '\n';
+                return 1;
+            }
 
-            if (std::get<s64>(v.as) != 0) {
-                i = std::get<s64>(addr.as);
-            } else {
-                i++;
+            if (fds.at(0).revents != 0) {
+                reap();
             }
-        } else if (word == "print") {
-            expect(1);
-            deq_t v = pop();
-            std::cout << v;
+            if ((fds.at(1).revents & POLLIN) != 0) {
+                int conn = ::accept(listener, nullptr, nullptr);
+                if (conn >= 0) {
+                    ::fcntl(conn, F_SETFL, ::fcntl(conn, F_GETFL) | O_NONBLOCK);
+                    pending.insert({ conn,
+                        { {}, Clock::now() + REQUEST_TIMEOUT } });
+                }
+            }
+            for (usz i = 2; i < fds.size(); i++) {
+                if (fds.at(i).revents != 0) {
+                    receive(fds.at(i).fd);
+                }
+            }
+            expire();
+        }
+    }
 
-            i++;
-        } else if (word == "println") {
-            expect(1);
-            deq_t v = pop();
-            std::cout << v << '\n';
+private:
+    using Clock = std::chrono::steady_clock;
 
-            i++;
-        } else if (word == "putc") {
-            expect(1);
-            deq_t v = pop();
-            DIAG(typecheck<1>({ v }, { Integer }));
-            std::cout << static_cast<char>(std::get<s64>(v.as));
+    // Requests are read alongside everything else, so a client that never
+    // finishes its request cannot stall the server
+    static constexpr auto REQUEST_TIMEOUT = std::chrono::seconds(5);
 
-            i++;
-        } else if (word == "calldir") {
-            push({ token, static_cast<s64>(std::get<1>(callstack.back())) });
+    struct Pending {
+        std::string request;
+        Clock::time_point deadline;
+    };
 
-            i++;
-        } else if (word == "invertdir") {
-            inverted = !inverted;
-            push({ token, static_cast<s64>(left) });
+    struct Cached {
+        std::vector<std::filesystem::file_time_type> mtimes;
+        Program prog;
+    };
 
-            i++;
-        } else if (word == "setinverted") {
-            expect(1);
-            deq_t v = pop();
-            DIAG(typecheck<1>({ v }, { Integer }));
-            inverted = static_cast<bool>(std::get<s64>(v.as));
+    // Modification times of `files`, nullopt if one of them is gone
+    static std::optional<std::vector<std::filesystem::file_time_type>> mtimes(
+        const std::vector<std::string>& files)
+    {
+        std::vector<std::filesystem::file_time_type> times;
+        for (const auto& file : files) {
+            std::error_code ec;
+            times.push_back(std::filesystem::last_write_time(file, ec));
+            if (ec) {
+                return {};
+            }
+        }
+        return times;
+    }
 
-            i++;
-        } else if (word == ">real") {
-            expect(1);
-            deq_t v = pop();
+    static inline int children[2] = { -1, -1 };
 
-            switch (v.type) {
-            case Integer:
-                DIAG(typecheck<1>({ v }, { Integer }));
-                push({ token, static_cast<f64>(std::get<s64>(v.as)) });
-                break;
-            case String:
-                DIAG(typecheck<1>({ v }, { String }));
-                push({ token,
-                    static_cast<f64>(std::stod(std::get<std::string>(v.as))) });
-                break;
-            case Real:
-                ERR("expected " << human(Integer) << " or " << human(String));
-                std::exit(1);
-                UNREACHABLE();
-            }
+    static void on_child_exit(int)
+    {
+        int saved = errno;
+        (void)!::write(children[1], "", 1);
+        errno = saved;
+    }
 
-            i++;
-        } else if (word == ">integer") {
-            expect(1);
-            deq_t v = pop();
+#if DEQ_STATS
+    // Adds up the statistics of the workers that exited and rewrites the file
+    void collect_stats()
+    {
+        if (reports[0] < 0) {
+            return;
+        }
 
-            switch (v.type) {
-            case Real:
-                DIAG(typecheck<1>({ v }, { Real }));
-                push({ token, static_cast<s64>(std::get<f64>(v.as)) });
-                break;
-            case String:
-                DIAG(typecheck<1>({ v }, { String }));
-                push({ token,
-                    static_cast<s64>(
-                        std::stoll(std::get<std::string>(v.as))) });
-                break;
-            case Integer:
-                ERR("expected " << human(Real) << " or " << human(String));
-                std::exit(1);
-                UNREACHABLE();
+        std::array<StatsTotals, 16> totals;
+        bool changed = false;
+        ssize_t n;
+        while ((n = ::read(reports[0], totals.data(), sizeof(totals))) > 0) {
+            for (usz i = 0; i < n / sizeof(StatsTotals); i++) {
+                report.totals.merge(totals.at(i));
             }
+            changed = true;
+        }
+        if (changed) {
+            save_stats();
+        }
+    }
+#endif
 
-            i++;
-        } else if (word == ">string") {
-            expect(1);
-            deq_t v = pop();
-            switch (v.type) {
-            case Integer:
-                DIAG(typecheck<1>({ v },
-                    { Integer })); // NOTE: Is this really needed? <2025-05-24>
-                push({ token, std::to_string(std::get<s64>(v.as)) });
-                break;
-            case Real:
-                DIAG(typecheck<1>({ v },
-                    { Real })); // NOTE: Is this really needed? <2025-05-24>
-                push({ token, std::to_string(std::get<f64>(v.as)) });
-                break;
-            case String:
-                ERR("expected " << human(Integer) << " or " << human(Real));
-                std::exit(1);
-                UNREACHABLE();
+    void reap()
+    {
+        // Workers send their statistics before exiting, so they are counted
+        // before their clients get the reply
+        STAT(collect_stats());
+
+        std::array<char, 64> buf;
+        while (::read(children[0], buf.data(), buf.size()) > 0) { }
+
+        int status;
+        pid_t pid;
+        while ((pid = ::waitpid(-1, &status, WNOHANG)) > 0) {
+            auto child = running.find(pid);
+            if (child == running.end()) {
+                continue;
             }
+            u8 code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                        : 128 + WTERMSIG(status);
+            reply(child->second, "", code);
+            running.erase(child);
+        }
+    }
 
-            i++;
-        } else {
-            if (labels.contains(word)) {
-                push({ token, static_cast<s64>(labels.at(word)) });
-                i++;
+    // Reads what the client has sent so far, the request is ready once the
+    // client shuts down its side
+    void receive(int conn)
+    {
+        auto& request = pending.at(conn).request;
+        std::array<char, 4096> buf;
+        for (;;) {
+            ssize_t n = ::read(conn, buf.data(), buf.size());
+            if (n > 0) {
+                request.append(buf.data(), n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n == 0) {
+                ready.push_back({ conn, std::move(request) });
             } else {
-                ERR("unexpected token");
-                std::exit(1);
+                ::close(conn);
             }
+            pending.erase(conn);
+            return;
         }
+    }
 
-        if (debug) {
-            std::cout << "\nCALLSTACK: ";
-            for (const auto& [i, isleft] : callstack) {
-                std::cout << i;
+    // Milliseconds until the first pending request times out, -1 if none
+    int next_timeout() const
+    {
+        if (pending.empty()) {
+            return -1;
+        }
+        auto deadline = Clock::time_point::max();
+        for (const auto& [_, p] : pending) {
+            deadline = std::min(deadline, p.deadline);
+        }
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - Clock::now());
+        return std::max<int>(left.count(), 0);
+    }
+
+    void expire()
+    {
+        auto now = Clock::now();
+        for (auto p = pending.begin(); p != pending.end();) {
+            if (p->second.deadline <= now) {
+                reply(p->first, "[ERR] Request timed out\n", 1);
+                p = pending.erase(p);
+            } else {
+                ++p;
             }
-            std::cout << '\n';
+        }
+    }
 
-            std::cout << "DEQUE STATE(inverted: " << inverted << "): ";
-            trace(deq);
+    static void reply(int conn, std::string_view output, u8 code)
+    {
+        (void)(write_all(conn, output)
+            && write_all(conn, { reinterpret_cast<char*>(&code), 1 }));
+        ::close(conn);
+    }
+
+    // nullptr if the script cannot be compiled, with the diagnostics in `diag`
+    const Program* compile(const std::string& path, std::ostream& diag)
+    {
+        auto cached = programs.find(path);
+        if (cached != programs.end()
+            && mtimes(cached->second.prog.files) == cached->second.mtimes) {
+            return &cached->second.prog;
+        }
+
+        auto* cerr = std::cerr.rdbuf(diag.rdbuf());
+        auto prog = link(path, modules, opts.opt_level);
+        std::cerr.rdbuf(cerr);
+        if (!prog) {
+            return nullptr;
+        }
+
+        // A file removed since is linked again on the next request
+        auto times = mtimes(prog->files).value_or(
+            std::vector<std::filesystem::file_time_type> {});
+        programs.insert_or_assign(path, Cached { times, std::move(*prog) });
+        return &programs.at(path).prog;
+    }
+
+    void handle(int conn, const std::string& request)
+    {
+        std::vector<std::string> lines;
+        std::istringstream is(request);
+        for (std::string line; std::getline(is, line);) {
+            lines.push_back(line);
+        }
+        if (lines.empty()) {
+            reply(conn, "[ERR] Empty request\n", 1);
+            return;
+        }
+
+        const auto& path = lines.front();
+        std::vector<Token> inputs;
+        for (usz i = 1; i < lines.size(); i++) {
+            Token token { Location { "<input>", 0, i - 1 }, lines.at(i) };
+            if (!valid_input(token.text)) {
+                std::ostringstream diag;
+                diag << token.loc << ": [ERR] invalid input value '"
+                     << token.text << "'\n";
+                reply(conn, diag.str(), 1);
+                return;
+            }
+            inputs.push_back(token);
+        }
+
+        std::ostringstream diag;
+        const auto* prog = compile(path, diag);
+        if (prog == nullptr) {
+            reply(conn, diag.str(), 1);
+            return;
+        }
+
+        pid_t pid = ::fork();
+        if (pid < 0) {
+            reply(conn, "[ERR] Failed to start a worker\n", 1);
+            return;
+        }
+        if (pid > 0) {
+            running.insert({ pid, conn });
+            return;
+        }
+
+        // The client only sees the end of the reply once every copy of its
+        // connection is closed, so drop the ones of the other requests
+        std::signal(SIGCHLD, SIG_DFL);
+        std::signal(SIGPIPE, SIG_DFL);
+        ::close(listener);
+        for (int fd : children) {
+            ::close(fd);
+        }
+        for (const auto& [_, fd] : running) {
+            ::close(fd);
+        }
+        for (const auto& [fd, _] : pending) {
+            ::close(fd);
+        }
+        for (const auto& [fd, _] : ready) {
+            ::close(fd);
+        }
+#if DEQ_STATS
+        if (reports[1] >= 0) {
+            ::close(reports[0]);
+            report.sink = reports[1];
+            report.totals = {};
+        }
+#endif
+        ::fcntl(conn, F_SETFL, ::fcntl(conn, F_GETFL) & ~O_NONBLOCK);
+        ::dup2(conn, STDOUT_FILENO);
+        ::dup2(conn, STDERR_FILENO);
+        ::close(conn);
+
+        Options run_opts = opts;
+        if (run_opts.snapshot_path.empty()) {
+            run_opts.snapshot_path = path + ".snap";
+        }
+        run(*prog, inputs, run_opts);
+        std::exit(0);
+    }
+
+    const Options& opts;
+    ModuleCache modules;
+    std::unordered_map<std::string, Cached> programs;
+    std::unordered_map<pid_t, int> running;
+    std::unordered_map<int, Pending> pending;
+#if DEQ_STATS
+    int reports[2] = { -1, -1 };
+#endif
+    // Requests read in full, waiting for a worker
+    std::deque<std::pair<int, std::string>> ready;
+    int listener = -1;
+};
+
+// Client side of `Server`
+static int request(const std::string& socket_path, const std::string& script,
+    const std::vector<std::string>& inputs)
+{
+    auto addr = socket_address(socket_path);
+    if (!addr) {
+        return 1;
+    }
+
+    // The server may still be starting up
+    int fd = -1;
+    for (int attempt = 0; attempt < 100; attempt++) {
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0
+            || ::connect(fd, reinterpret_cast<sockaddr*>(&*addr), sizeof(*addr))
+                == 0) {
+            break;
+        }
+        ::close(fd);
+        fd = -1;
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            break;
         }
+        ::usleep(10000);
+    }
+    if (fd < 0) {
+        std::cerr << "[ERR] Failed to connect to '" << socket_path
+                  << "': " << std::strerror(errno) << '\n';
+        return 1;
+    }
+
+    std::string req
+        = std::filesystem::absolute(script).lexically_normal().string() + '\n';
+    for (const auto& input : inputs) {
+        req += input + '\n';
+    }
+
+    std::string reply;
+    if (!write_all(fd, req) || ::shutdown(fd, SHUT_WR) < 0
+        || !read_all(fd, reply) || reply.empty()) {
+        std::cerr << "[ERR] Request to '" << socket_path << "' failed\n";
+        ::close(fd);
+        return 1;
     }
+    ::close(fd);
+
+    u8 code = reply.back();
+    std::cout.write(reply.data(), reply.size() - 1);
+    return code;
 }
 
 static void usage(const char* program)
 {
-    std::cout << "Usage: " << program << " [-d] file.deq\n";
+    std::cout << "Usage: " << program << " [options] file.deq\n"
+              << "       " << program << " [options] --serve SOCKET\n"
+              << "       " << program
+              << " --connect SOCKET file.deq [value...]\n";
 }
 
 int main(int argc, char** argv)
@@ -869,13 +3081,110 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    bool debug = false;
+    Options opts;
     const char* source = nullptr;
+    const char* serve_path = nullptr;
+    const char* connect_path = nullptr;
+    const char* stats_path = nullptr;
+    [[maybe_unused]] bool stats_prometheus = false;
+    std::vector<std::string> inputs;
 
     for (int i = 1; i < argc; i++) {
         const char* arg = argv[i];
         if (std::strcmp(arg, "-d") == 0) {
-            debug = true;
+            opts.debug = true;
+        } else if (std::strcmp(arg, "-O0") == 0) {
+            opts.opt_level = 0;
+        } else if (std::strcmp(arg, "-O1") == 0) {
+            opts.opt_level = 1;
+        } else if (std::strcmp(arg, "--dump-ir") == 0) {
+            opts.dump_ir = true;
+        } else if (std::strcmp(arg, "--call-depth") == 0) {
+            auto depth = i + 1 < argc ? parse_number<usz>(argv[++i])
+                                      : std::nullopt;
+            if (!depth || *depth == 0 || *depth > MAX_CALL_DEPTH) {
+                std::cerr << "--call-depth expects a positive integer up to "
+                          << MAX_CALL_DEPTH << '\n';
+                usage(program);
+                return 1;
+            }
+            opts.call_depth = *depth;
+        } else if (std::strcmp(arg, "--cache") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "--cache expects a directory\n";
+                usage(program);
+                return 1;
+            }
+            opts.cache_dir = argv[++i];
+        } else if (std::strcmp(arg, "--snapshot") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "--snapshot expects a file\n";
+                usage(program);
+                return 1;
+            }
+            opts.snapshot_path = argv[++i];
+        } else if (std::strcmp(arg, "--spill") == 0) {
+            opts.spill_block = DEFAULT_SPILL_BLOCK;
+        } else if (std::strcmp(arg, "--spill-block") == 0) {
+            auto block = i + 1 < argc ? parse_number<usz>(argv[++i])
+                                      : std::nullopt;
+            if (!block || *block == 0) {
+                std::cerr << "--spill-block expects a positive integer\n";
+                usage(program);
+                return 1;
+            }
+            opts.spill_block = *block;
+        } else if (std::strcmp(arg, "--restore") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "--restore expects a file\n";
+                usage(program);
+                return 1;
+            }
+            opts.restore_path = argv[++i];
+        } else if (std::strcmp(arg, "--serve") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "--serve expects a socket path\n";
+                usage(program);
+                return 1;
+            }
+            serve_path = argv[++i];
+        } else if (std::strcmp(arg, "--connect") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "--connect expects a socket path\n";
+                usage(program);
+                return 1;
+            }
+            connect_path = argv[++i];
+        } else if (std::strcmp(arg, "--workers") == 0) {
+            auto workers = i + 1 < argc ? parse_number<usz>(argv[++i])
+                                        : std::nullopt;
+            if (!workers || *workers == 0) {
+                std::cerr << "--workers expects a positive integer\n";
+                usage(program);
+                return 1;
+            }
+            opts.workers = *workers;
+        } else if (std::strcmp(arg, "--stats") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "--stats expects a file\n";
+                usage(program);
+                return 1;
+            }
+            stats_path = argv[++i];
+        } else if (std::strcmp(arg, "--stats-format") == 0) {
+            std::string_view format = i + 1 < argc ? argv[++i] : "";
+            if (format != "json" && format != "prom") {
+                std::cerr << "--stats-format expects 'json' or 'prom'\n";
+                usage(program);
+                return 1;
+            }
+            stats_prometheus = format == "prom";
+        } else if (source != nullptr && connect_path != nullptr) {
+            if (!valid_input(arg)) {
+                std::cerr << "invalid input value '" << arg << "'\n";
+                return 1;
+            }
+            inputs.push_back(arg);
         } else {
             if (source != nullptr) {
                 std::cerr << "unexpected CLI argument '" << arg << "'\n";
@@ -886,8 +3195,48 @@ int main(int argc, char** argv)
         }
     }
 
-    Lexer l(source);
-    auto tox = l.lex();
+    if (stats_path != nullptr) {
+#if DEQ_STATS
+        report.path = stats_path;
+        report.prometheus = stats_prometheus;
+        std::atexit(write_stats);
+#else
+        std::cerr << "deq was built without statistics (STATS=0)\n";
+        return 1;
+#endif
+    }
+
+    if (serve_path != nullptr) {
+        Server server(opts);
+        return server.serve(serve_path);
+    }
+
+    if (source == nullptr) {
+        std::cerr << "No input file was provided!\n";
+        usage(program);
+        return 1;
+    }
+
+    if (connect_path != nullptr) {
+        return request(connect_path, source, inputs);
+    }
+
+    if (opts.snapshot_path.empty()) {
+        opts.snapshot_path = std::string(source) + ".snap";
+    }
+
+    ModuleCache cache(opts.cache_dir);
+    auto prog = link(source, cache, opts.opt_level);
+    if (!prog) {
+        STAT(failure = Failure::Compile);
+        return 1;
+    }
+
+    if (opts.dump_ir) {
+        dump_ir(link(source, cache, 0)->tox, "before");
+        dump_ir(prog->tox, "after -O" + std::to_string(opts.opt_level));
+        return 0;
+    }
 
-    interpret(tox, debug);
+    run(*prog, {}, opts);
 }